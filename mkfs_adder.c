@@ -1,4 +1,5 @@
 // Build: gcc -O2 -std=c17 -Wall -Wextra mkfs_adder.c -o mkfs_adder
+#define _GNU_SOURCE
 #define _FILE_OFFSET_BITS 64
 #include <stdio.h>
 #include <stdlib.h>
@@ -8,12 +9,32 @@
 #include <errno.h>
 #include <time.h>
 #include <assert.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#ifdef __linux__
+#include <linux/fs.h> // FICLONE
+#endif
 
 #define BS 4096u
 #define INODE_SIZE 128u
 #define ROOT_INO 1u
 #define DIRECT_MAX 12
 
+// superblock_t.flags
+#define SB_FLAG_ITABLE_UNINIT 0x1u // inode table blocks past the high-water mark are unwritten (read as zero)
+
+// superblock_t.version
+#define SB_VERSION 1u
+#define SB_VERSION_LAZY_ITABLE 2u // may carry SB_FLAG_ITABLE_UNINIT; mkfs_adder/mkfs_compactor reject versions they don't know,
+                                  // but older builds never checked the version and will mishandle such an image
+
+// The lazy-init high-water mark (number of initialized inode table blocks) lives
+// in block 0 right after superblock_t, so the spec layout is unchanged while the
+// superblock checksum still covers it.
+#define SB_ITABLE_INIT_OFF 116u
+
 #pragma pack(push,1)
 typedef struct {
     uint32_t magic;
@@ -94,6 +115,16 @@ static uint32_t superblock_crc_finalize(superblock_t *sb) {
     return c;
 }
 
+// sb must point at the start of a full BS-sized block 0 buffer
+static uint64_t sb_itable_init_blocks(const superblock_t* sb) {
+    uint64_t v;
+    memcpy(&v,(const uint8_t*)sb+SB_ITABLE_INIT_OFF,sizeof(v));
+    return v;
+}
+static void sb_set_itable_init_blocks(superblock_t* sb, uint64_t v) {
+    memcpy((uint8_t*)sb+SB_ITABLE_INIT_OFF,&v,sizeof(v));
+}
+
 // WARNING: CALL THIS ONLY AFTER ALL OTHER INODE ELEMENTS HAVE BEEN FINALIZED
 static uint32_t inode_crc_finalize(inode_t* in) {
     // low 4 bytes store crc32 of bytes [0..119]; high 4 bytes 0
@@ -103,6 +134,112 @@ static uint32_t inode_crc_finalize(inode_t* in) {
     return c;
 }
 
+// Fills `blk` with the empty (CRC'd) inodes of inode table block `blk_no`, as
+// mkfs_builder writes them; used for blocks past the lazy-init high-water mark.
+static void itable_init_block(uint8_t* blk, uint64_t blk_no, uint64_t inode_count) {
+    uint64_t inodes_per_block=BS/INODE_SIZE;
+    memset(blk,0,BS);
+    for(uint64_t slot=0; slot<inodes_per_block; slot++){
+        if(blk_no*inodes_per_block+slot>=inode_count) break;
+        inode_t ino; memset(&ino,0,sizeof(ino));
+        inode_crc_finalize(&ino);
+        memcpy(blk+slot*INODE_SIZE,&ino,sizeof(ino));
+    }
+}
+
+static int read_block(int fd, uint64_t blk_no, void* buf) {
+    return pread(fd,buf,BS,(off_t)(blk_no*BS))==(ssize_t)BS ? 0 : -1;
+}
+
+static int write_block(int fd, uint64_t blk_no, const void* buf) {
+    ssize_t n=pwrite(fd,buf,BS,(off_t)(blk_no*BS));
+    if(n==(ssize_t)BS) return 0;
+    if(n>=0) errno=EIO; // short write
+    return -1;
+}
+
+// one block of the output to overwrite; `what` names it in error messages
+typedef struct {
+    uint64_t blk;
+    const uint8_t* buf;
+    const char* what;
+} patch_t;
+
+// Writes the patches in order and stops at the first failure, reporting it there.
+static int write_patches(int fd, const patch_t* p, size_t n) {
+    for(size_t i=0;i<n;i++){
+        if(write_block(fd,p[i].blk,p[i].buf)!=0){
+            fprintf(stderr,"Error: writing %s (block %llu): %s\n", p[i].what, (unsigned long long)p[i].blk, strerror(errno));
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Copies bytes [off, end) of in_fd to the same offsets of out_fd, in the kernel
+// with copy_file_range while that works, otherwise through a bounded buffer.
+// Reports its own errors.
+static int copy_range(int in_fd, int out_fd, off_t off, off_t end, int* use_cfr, uint8_t** buf) {
+#ifdef __linux__
+    while(*use_cfr && off<end){
+        loff_t in_off=off, out_off=off;
+        ssize_t n=copy_file_range(in_fd,&in_off,out_fd,&out_off,(size_t)(end-off),0);
+        if(n<=0){ *use_cfr=0; break; } // unsupported here: fall back from this offset on
+        off+=n;
+    }
+#else
+    *use_cfr=0;
+#endif
+    size_t chunk=1u<<20;
+    if(off<end && !*buf && !(*buf=(uint8_t*)malloc(chunk))){ fprintf(stderr,"Error: clone image: OOM\n"); return -1; }
+    while(off<end){
+        size_t want=(size_t)((end-off)<(off_t)chunk ? (end-off) : (off_t)chunk);
+        ssize_t n=pread(in_fd,*buf,want,off);
+        if(n<0){ fprintf(stderr,"Error: clone image: reading input: %s\n", strerror(errno)); return -1; }
+        if(n==0){ fprintf(stderr,"Error: clone image: input ended early\n"); return -1; }
+        ssize_t w=pwrite(out_fd,*buf,(size_t)n,off);
+        if(w!=n){
+            fprintf(stderr,"Error: clone image: writing output: %s\n", w<0 ? strerror(errno) : "short write");
+            return -1;
+        }
+        off+=n;
+    }
+    return 0;
+}
+
+// Makes out_fd a copy of the first `len` bytes of in_fd without staging the
+// image in user memory: a reflink where the filesystem supports it, otherwise
+// the output is sized with ftruncate and only the input's data extents are
+// copied, so holes (e.g. a --lazy-itable image) stay holes. Reports its own
+// errors.
+static int clone_image(int in_fd, int out_fd, off_t len, const char** how) {
+#ifdef FICLONE
+    if(ioctl(out_fd,FICLONE,in_fd)==0){ *how="reflink"; return 0; }
+#endif
+    if(ftruncate(out_fd,len)!=0){ fprintf(stderr,"Error: clone image: sizing output: %s\n", strerror(errno)); return -1; }
+    int use_cfr=1;
+    uint8_t* buf=NULL;
+    off_t off=0;
+    while(off<len){
+        off_t data=off, hole=len;
+#ifdef SEEK_DATA
+        data=lseek(in_fd,off,SEEK_DATA);
+        if(data<0 && errno==ENXIO) break; // only a hole remains
+        if(data<0){ data=off; hole=len; } // no SEEK_DATA support: copy the rest
+        else {
+            hole=lseek(in_fd,data,SEEK_HOLE);
+            if(hole<0 || hole>len) hole=len;
+        }
+#endif
+        if(data>=len) break;
+        if(copy_range(in_fd,out_fd,data,hole,&use_cfr,&buf)!=0){ free(buf); return -1; }
+        off=hole;
+    }
+    free(buf);
+    *how = use_cfr ? "sparse copy_file_range" : "sparse read/write";
+    return 0;
+}
+
 // WARNING: CALL THIS ONLY AFTER ALL OTHER SUPERBLOCK ELEMENTS HAVE BEEN FINALIZED
 void dirent_checksum_finalize(dirent64_t* de) {
     const uint8_t* p = (const uint8_t*)de;
@@ -126,27 +263,36 @@ int main(int argc, char** argv) {
         return 1;
     }
 
-    
-    FILE* fi = fopen(in_path,"rb");
-    if(!fi){ perror("fopen input"); return 1; }
-    fseek(fi,0,SEEK_END);
-    long fsz = ftell(fi);
-    fseek(fi,0,SEEK_SET);
-    size_t img_bytes = (size_t)fsz;
-    uint8_t* img = (uint8_t*)malloc(img_bytes);
-    if(!img){ fclose(fi); fprintf(stderr,"OOM\n"); return 1; }
-    if(fread(img,1,img_bytes,fi)!=img_bytes){ fclose(fi); free(img); fprintf(stderr,"read image failed\n"); return 1; }
-    fclose(fi);
-
-    superblock_t* sb = (superblock_t*)img;
-    uint8_t* inode_bitmap = img + sb->inode_bitmap_start*BS;
-    uint8_t* data_bitmap  = img + sb->data_bitmap_start*BS;
-    uint8_t* inode_table  = img + sb->inode_table_start*BS;
-    uint8_t* data_region  = img + sb->data_region_start*BS;
+    // Only the metadata blocks the add touches are read; the output is cloned
+    // from the input afterwards and patched block by block.
+    struct stat in_st, out_st;
+    int in_place = stat(in_path,&in_st)==0 && stat(out_path,&out_st)==0
+                   && in_st.st_dev==out_st.st_dev && in_st.st_ino==out_st.st_ino;
+    int fd_in = open(in_path, in_place ? O_RDWR : O_RDONLY);
+    if(fd_in<0){ perror("open input"); return 1; }
+    if(fstat(fd_in,&in_st)!=0){ perror("fstat input"); close(fd_in); return 1; }
+
+    static uint8_t sb_blk[BS], inode_bitmap[BS], data_bitmap[BS], itab_root[BS], itab_new[BS], dir_blk[BS], itab_empty[BS];
+    if(read_block(fd_in,0,sb_blk)!=0){ fprintf(stderr,"read image failed\n"); close(fd_in); return 1; }
+    superblock_t* sb = (superblock_t*)sb_blk;
+    if(sb->block_size!=BS || (uint64_t)in_st.st_size<sb->total_blocks*BS){
+        fprintf(stderr,"Error: '%s' is not a valid MiniVSFS image\n", in_path); close(fd_in); return 1;
+    }
+    if(sb->version!=SB_VERSION && sb->version!=SB_VERSION_LAZY_ITABLE){
+        fprintf(stderr,"Error: unsupported MiniVSFS version %u\n", sb->version); close(fd_in); return 1;
+    }
+    if((sb->flags & SB_FLAG_ITABLE_UNINIT)
+       && (sb->version!=SB_VERSION_LAZY_ITABLE || sb_itable_init_blocks(sb)==0 || sb_itable_init_blocks(sb)>sb->inode_table_blocks)){
+        fprintf(stderr,"Error: '%s' has a corrupt inode table high-water mark\n", in_path); close(fd_in); return 1;
+    }
+    if(read_block(fd_in,sb->inode_bitmap_start,inode_bitmap)!=0 || read_block(fd_in,sb->data_bitmap_start,data_bitmap)!=0
+       || read_block(fd_in,sb->inode_table_start,itab_root)!=0){
+        fprintf(stderr,"read image failed\n"); close(fd_in); return 1;
+    }
 
     
     FILE* fadd = fopen(file_path,"rb");
-    if(!fadd){ perror("fopen file"); free(img); return 1; }
+    if(!fadd){ perror("fopen file"); close(fd_in); return 1; }
     fseek(fadd,0,SEEK_END);
     long fsz_in = ftell(fadd);
     fseek(fadd,0,SEEK_SET);
@@ -163,12 +309,12 @@ int main(int argc, char** argv) {
         uint8_t b = inode_bitmap[i>>3u];
         if(((b>>(i&7u))&1u)==0u){ free_ino_index=i; break; }
     }
-    if(free_ino_index==(uint64_t)-1){ fprintf(stderr,"Error: no free inode\n"); free(img); return 1; }
+    if(free_ino_index==(uint64_t)-1){ fprintf(stderr,"Error: no free inode\n"); fclose(fadd); close(fd_in); return 1; }
     uint32_t new_ino_no = (uint32_t)(free_ino_index + 1); 
 
     
     uint64_t need_blocks = (fsz_in<=0)?0:((uint64_t)(fsz_in-1)/BS + 1);
-    if(need_blocks>DIRECT_MAX){ fprintf(stderr,"Warning: file too large for MiniVSFS (max 12 blocks)\n"); free(img); return 1; }
+    if(need_blocks>DIRECT_MAX){ fprintf(stderr,"Warning: file too large for MiniVSFS (max 12 blocks)\n"); fclose(fadd); close(fd_in); return 1; }
 
     uint32_t direct[DIRECT_MAX]={0};
     uint64_t got=0;
@@ -180,19 +326,13 @@ int main(int argc, char** argv) {
             direct[got++] = (uint32_t)(sb->data_region_start + bi);
         }
     }
-    if(got<need_blocks){ fprintf(stderr,"Error: not enough data blocks\n"); free(img); return 1; }
+    if(got<need_blocks){ fprintf(stderr,"Error: not enough data blocks\n"); fclose(fadd); close(fd_in); return 1; }
 
-   
-    for(uint64_t i=0;i<need_blocks;i++){
-        size_t to_read = (size_t)((i+1)*BS <= (uint64_t)fsz_in ? BS : (uint64_t)fsz_in - i*BS);
-        if(to_read>0){
-            if(fread(data_region + (direct[i]-sb->data_region_start)*BS, 1, to_read, fadd)!=to_read){
-                fprintf(stderr,"Error: reading input file\n"); free(img); fclose(fadd); return 1;
-            }
-        }
-        if(to_read<BS){
-            memset(data_region + (direct[i]-sb->data_region_start)*BS + to_read, 0, BS - to_read);
-        }
+    // file contents are bounded by DIRECT_MAX blocks, so stage them up front
+    static uint8_t fdata[DIRECT_MAX*BS];
+    memset(fdata,0,sizeof(fdata));
+    if(fsz_in>0 && fread(fdata,1,(size_t)fsz_in,fadd)!=(size_t)fsz_in){
+        fprintf(stderr,"Error: reading input file\n"); fclose(fadd); close(fd_in); return 1;
     }
     fclose(fadd);
 
@@ -213,12 +353,32 @@ int main(int argc, char** argv) {
     uint64_t inodes_per_block=BS/INODE_SIZE;
     uint64_t blk_offset=free_ino_index/inodes_per_block;
     uint64_t slot=free_ino_index%inodes_per_block;
-    memcpy(inode_table+blk_offset*BS+slot*INODE_SIZE,&ino,sizeof(ino));
+
+    // Blocks past the lazy-init high-water mark are zero on disk; every block
+    // from the mark up to the one holding the new inode gets initialized.
+    uint64_t lazy_first=0, lazy_end=0;
+    if((sb->flags & SB_FLAG_ITABLE_UNINIT) && blk_offset>=sb_itable_init_blocks(sb)){
+        lazy_first=sb_itable_init_blocks(sb);
+        lazy_end=blk_offset;
+        sb_set_itable_init_blocks(sb,blk_offset+1);
+        if(blk_offset+1>=sb->inode_table_blocks){
+            // table complete: back to a plain version 1 image
+            sb->flags &= ~SB_FLAG_ITABLE_UNINIT;
+            sb->version=SB_VERSION;
+            sb_set_itable_init_blocks(sb,0);
+        }
+        itable_init_block(itab_new,blk_offset,sb->inode_count);
+    } else if(blk_offset!=0 && read_block(fd_in,sb->inode_table_start+blk_offset,itab_new)!=0){
+        fprintf(stderr,"read image failed\n"); close(fd_in); return 1;
+    }
+    uint8_t* itab = blk_offset==0 ? itab_root : itab_new;
+    memcpy(itab+slot*INODE_SIZE,&ino,sizeof(ino));
 
     
-    inode_t root; memcpy(&root,inode_table,sizeof(root));
+    inode_t root; memcpy(&root,itab_root,sizeof(root));
     uint32_t rootblk=root.direct[0];
-    dirent64_t* dirents=(dirent64_t*)(img+rootblk*BS);
+    if(read_block(fd_in,rootblk,dir_blk)!=0){ fprintf(stderr,"read image failed\n"); close(fd_in); return 1; }
+    dirent64_t* dirents=(dirent64_t*)dir_blk;
     size_t slots=BS/sizeof(dirent64_t);
 
    
@@ -227,7 +387,7 @@ int main(int argc, char** argv) {
             
             if (strncmp(dirents[i].name, fname, sizeof(dirents[i].name)) == 0) {
                 fprintf(stderr, "Error: File '%s' already exists in the filesystem.\n", fname);
-                free(img);
+                close(fd_in);
                 return 1;
             }
         }
@@ -239,7 +399,7 @@ int main(int argc, char** argv) {
     }
     if(free_slot==SIZE_MAX){
         fprintf(stderr,"Error: root dir full\n");
-        free(img); return 1;
+        close(fd_in); return 1;
     }
     dirent64_t de; memset(&de,0,sizeof(de));
     de.inode_no=new_ino_no;
@@ -250,20 +410,67 @@ int main(int argc, char** argv) {
 
     root.links+=1;
     inode_crc_finalize(&root);
-    memcpy(inode_table,&root,sizeof(root));
+    memcpy(itab_root,&root,sizeof(root));
 
     
     superblock_crc_finalize(sb);
 
     
-    FILE* fo=fopen(out_path,"wb");
-    fwrite(img,1,img_bytes,fo);
-    fclose(fo);
-    free(img);
+    const char* how=NULL;
+    int fd_out = fd_in;
+    int out_is_reg = 0;
+    if(!in_place){
+        fd_out=open(out_path,O_WRONLY|O_CREAT|O_TRUNC,0644);
+        if(fd_out<0){ perror("open output"); close(fd_in); return 1; }
+        // a partial output is removed on failure, but never a device or fifo
+        out_is_reg = fstat(fd_out,&out_st)==0 && S_ISREG(out_st.st_mode);
+        if(clone_image(fd_in,fd_out,in_st.st_size,&how)!=0){
+            close(fd_out); if(out_is_reg) unlink(out_path); close(fd_in); return 1;
+        }
+    }
+
+    // Data and freshly initialized inode table blocks go first, then the
+    // bitmaps, then the blocks that reference them. The superblock is written
+    // last, only after everything else was written, so a failed add never
+    // leaves a superblock describing a half-written image.
+    uint64_t patched=0;
+    int failed=0;
+    for(uint64_t blk=lazy_first; blk<lazy_end && !failed; blk++){
+        itable_init_block(itab_empty,blk,sb->inode_count);
+        patch_t p={sb->inode_table_start+blk,itab_empty,"inode table"};
+        failed=write_patches(fd_out,&p,1)!=0;
+        patched++;
+    }
+    patch_t patches[DIRECT_MAX+6];
+    size_t np=0;
+    for(uint64_t i=0;i<need_blocks;i++) patches[np++]=(patch_t){direct[i],fdata+i*BS,"file data"};
+    patches[np++]=(patch_t){sb->inode_bitmap_start,inode_bitmap,"inode bitmap"};
+    patches[np++]=(patch_t){sb->data_bitmap_start,data_bitmap,"data bitmap"};
+    if(blk_offset!=0) patches[np++]=(patch_t){sb->inode_table_start+blk_offset,itab_new,"inode table"};
+    patches[np++]=(patch_t){sb->inode_table_start,itab_root,"root inode"};
+    patches[np++]=(patch_t){rootblk,dir_blk,"root directory"};
+    if(!failed) failed=write_patches(fd_out,patches,np)!=0;
+    // in place, make the other blocks durable before the superblock that
+    // describes them; a fresh clone has no older state worth protecting and
+    // syncing it would flush the whole copy
+    if(!failed && in_place && fsync(fd_out)!=0){ perror("fsync output"); failed=1; }
+    if(!failed){
+        patch_t p={0,sb_blk,"superblock"};
+        failed=write_patches(fd_out,&p,1)!=0;
+    }
+    patched+=np+1;
+    if(failed){
+        if(fd_out!=fd_in){ close(fd_out); if(out_is_reg) unlink(out_path); }
+        close(fd_in);
+        return 1;
+    }
+    if(fd_out!=fd_in) close(fd_out);
+    close(fd_in);
 
     printf("Added '%s' (%ld bytes) as inode #%u using %llu block(s). Output: %s\n",
            fname, fsz_in, new_ino_no, (unsigned long long)need_blocks, out_path);
+    if(in_place) printf("Patched %llu block(s) in place\n", (unsigned long long)patched);
+    else printf("Cloned input via %s, patched %llu block(s)\n", how, (unsigned long long)patched);
 
     return 0;
 }
-
@@ -13,6 +13,19 @@
 #define INODE_SIZE 128u
 #define ROOT_INO 1u
 
+// superblock_t.flags
+#define SB_FLAG_ITABLE_UNINIT 0x1u // inode table blocks past the high-water mark are unwritten (read as zero)
+
+// superblock_t.version
+#define SB_VERSION 1u
+#define SB_VERSION_LAZY_ITABLE 2u // may carry SB_FLAG_ITABLE_UNINIT; mkfs_adder/mkfs_compactor reject versions they don't know,
+                                  // but older builds never checked the version and will mishandle such an image
+
+// The lazy-init high-water mark (number of initialized inode table blocks) lives
+// in block 0 right after superblock_t, so the spec layout is unchanged while the
+// superblock checksum still covers it.
+#define SB_ITABLE_INIT_OFF 116u
+
 uint64_t g_random_seed = 0; // This should be replaced by seed value from the CLI.
 
 // below contains some basic structures you need for your project
@@ -124,6 +137,12 @@ static uint32_t superblock_crc_finalize(superblock_t *sb)
     return s;
 }
 
+// sb must point at the start of the BS-sized block 0 buffer
+static void sb_set_itable_init_blocks(superblock_t *sb, uint64_t v)
+{
+    memcpy((uint8_t *)sb + SB_ITABLE_INIT_OFF, &v, sizeof(v));
+}
+
 // WARNING: CALL THIS ONLY AFTER ALL OTHER SUPERBLOCK ELEMENTS HAVE BEEN FINALIZED
 void inode_crc_finalize(inode_t *ino)
 {
@@ -162,7 +181,7 @@ static inline int bitmap_test(const uint8_t *bm, uint64_t idx)
 void print_usage(const char *prog)
 {
     fprintf(stderr,
-            "Usage: %s --image out.img --size-kib <180..4096> --inodes <128..512>\n"
+            "Usage: %s --image out.img --size-kib <180..4096> --inodes <128..512> [--lazy-itable]\n"
             "Example: %s --image out.img --size-kib 1024 --inodes 128\n",
             prog, prog);
 }
@@ -174,6 +193,7 @@ int main(int argc, char **argv)
     const char *image_path = NULL;
     uint64_t size_kib = 0;
     uint64_t inode_count = 0;
+    int lazy_itable = 0;
 
 
     for (int i = 1; i < argc; i++)
@@ -208,6 +228,10 @@ int main(int argc, char **argv)
             inode_count = (uint64_t)strtoull(argv[i + 1], NULL, 10);
             i++;
         }
+        else if (strcmp(argv[i], "--lazy-itable") == 0)
+        {
+            lazy_itable = 1;
+        }
         else
         {
             fprintf(stderr, "Unknown argument: %s\n", argv[i]);
@@ -259,8 +283,9 @@ int main(int argc, char **argv)
     printf("Inodes: %" PRIu64 ", inode table blocks: %" PRIu64 "\n", inode_count, inode_table_blocks);
     printf("inode bitmap at block %" PRIu64 ", data bitmap at block %" PRIu64 "\n",
            inode_bitmap_start, data_bitmap_start);
-    printf("inode table starts at block %" PRIu64 " (%" PRIu64 " blocks)\n",
-           inode_table_start, inode_table_blocks);
+    printf("inode table starts at block %" PRIu64 " (%" PRIu64 " blocks%s)\n",
+           inode_table_start, inode_table_blocks,
+           (lazy_itable && inode_table_blocks > 1) ? ", lazily initialized" : "");
     printf("data region starts at block %" PRIu64 " (%" PRIu64 " blocks)\n",
            data_region_start, data_region_blocks);
 
@@ -286,7 +311,7 @@ int main(int argc, char **argv)
     superblock_t *sb = (superblock_t *)block; 
 
     sb->magic = 0x4D565346u; 
-    sb->version = 1u;
+    sb->version = SB_VERSION;
     sb->block_size = BS;
     sb->total_blocks = total_blocks;
     sb->inode_count = inode_count;
@@ -301,6 +326,16 @@ int main(int argc, char **argv)
     sb->root_inode = ROOT_INO;
     sb->mtime_epoch = (uint64_t)time(NULL);
     sb->flags = 0;
+    uint64_t inode_table_init_blocks = inode_table_blocks;
+    if (lazy_itable && inode_table_blocks > 1)
+    {
+        // only the block holding the root inode is written now; the adder
+        // initializes the rest on demand
+        inode_table_init_blocks = 1;
+        sb->version = SB_VERSION_LAZY_ITABLE;
+        sb->flags |= SB_FLAG_ITABLE_UNINIT;
+        sb_set_itable_init_blocks(sb, inode_table_init_blocks);
+    }
    
     superblock_crc_finalize(sb); 
 
@@ -339,7 +374,7 @@ int main(int argc, char **argv)
 
     
    
-    for (uint64_t blk = 0; blk < inode_table_blocks; ++blk)
+    for (uint64_t blk = 0; blk < inode_table_init_blocks; ++blk)
     {
         memset(block, 0, BS);
         for (uint64_t slot = 0; slot < inodes_per_block; ++slot)
@@ -391,8 +426,23 @@ int main(int argc, char **argv)
         }
     }
 
+    if (inode_table_init_blocks < inode_table_blocks)
+    {
+        // skip the uninitialized tail of the inode table; it reads back as zeros
+        if (fseek(f, (long)((inode_table_start + inode_table_blocks) * BS), SEEK_SET) != 0)
+        {
+            perror("fseek");
+            free(block);
+            fclose(f);
+            return 1;
+        }
+    }
+
     
-    for (uint64_t dblk = 0; dblk < data_region_blocks; ++dblk)
+    // only the root directory block is written; the rest of the (all-zero) data
+    // region is left as a hole so formatting time does not grow with image size
+    uint64_t data_write_blocks = 1;
+    for (uint64_t dblk = 0; dblk < data_write_blocks; ++dblk)
     {
         memset(block, 0, BS);
         if (dblk == 0)
@@ -428,6 +478,18 @@ int main(int argc, char **argv)
         }
     }
 
+    if (data_write_blocks < data_region_blocks)
+    {
+        // writing the last block gives the image its full size
+        memset(block, 0, BS);
+        if (fseek(f, (long)((total_blocks - 1) * BS), SEEK_SET) != 0 || fwrite(block, 1, BS, f) != BS)
+        {
+            perror("fwrite");
+            free(block);
+            fclose(f);
+            return 1;
+        }
+    }
     
     fflush(f);
     free(block);
@@ -0,0 +1,427 @@
+// Build: gcc -O2 -std=c17 -Wall -Wextra mkfs_compactor.c -o mkfs_compactor
+#define _POSIX_C_SOURCE 200809L
+#define _FILE_OFFSET_BITS 64
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <time.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define BS 4096u
+#define INODE_SIZE 128u
+#define ROOT_INO 1u
+#define DIRECT_MAX 12
+
+// superblock_t.flags
+#define SB_FLAG_ITABLE_UNINIT 0x1u // inode table blocks past the high-water mark are unwritten (read as zero)
+
+// superblock_t.version
+#define SB_VERSION 1u
+#define SB_VERSION_LAZY_ITABLE 2u // may carry SB_FLAG_ITABLE_UNINIT; mkfs_adder/mkfs_compactor reject versions they don't know,
+                                  // but older builds never checked the version and will mishandle such an image
+
+// The lazy-init high-water mark (number of initialized inode table blocks) lives
+// in block 0 right after superblock_t, so the spec layout is unchanged while the
+// superblock checksum still covers it.
+#define SB_ITABLE_INIT_OFF 116u
+#define MAGIC 0x4D565346u
+
+#pragma pack(push,1)
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t block_size;
+    uint64_t total_blocks;
+    uint64_t inode_count;
+    uint64_t inode_bitmap_start;
+    uint64_t inode_bitmap_blocks;
+    uint64_t data_bitmap_start;
+    uint64_t data_bitmap_blocks;
+    uint64_t inode_table_start;
+    uint64_t inode_table_blocks;
+    uint64_t data_region_start;
+    uint64_t data_region_blocks;
+    uint64_t root_inode;
+    uint64_t mtime_epoch;
+    uint32_t flags;
+    uint32_t checksum;
+} superblock_t;
+#pragma pack(pop)
+_Static_assert(sizeof(superblock_t) == 116, "superblock must fit in one block");
+
+#pragma pack(push,1)
+typedef struct {
+    uint16_t mode;
+    uint16_t links;
+    uint32_t uid;
+    uint32_t gid;
+    uint64_t size_bytes;
+    uint64_t atime;
+    uint64_t mtime;
+    uint64_t ctime;
+    uint32_t direct[12];
+    uint32_t reserved_0;
+    uint32_t reserved_1;
+    uint32_t reserved_2;
+    uint32_t proj_id;
+    uint32_t uid16_gid16;
+    uint64_t xattr_ptr;
+    // THIS FIELD SHOULD STAY AT THE END
+    uint64_t inode_crc;
+} inode_t;
+#pragma pack(pop)
+_Static_assert(sizeof(inode_t)==INODE_SIZE, "inode size mismatch");
+
+// ====================================CRC32====================================
+uint32_t CRC32_TAB[256];
+void crc32_init(void){
+    for (uint32_t i=0;i<256;i++){
+        uint32_t c=i;
+        for(int j=0;j<8;j++) c = (c&1)?(0xEDB88320u^(c>>1)):(c>>1);
+        CRC32_TAB[i]=c;
+    }
+}
+uint32_t crc32(const void* data, size_t n){
+    const uint8_t* p=(const uint8_t*)data; uint32_t c=0xFFFFFFFFu;
+    for(size_t i=0;i<n;i++) c = CRC32_TAB[(c^p[i])&0xFF] ^ (c>>8);
+    return c ^ 0xFFFFFFFFu;
+}
+// ====================================CRC32====================================
+
+// WARNING: CALL THIS ONLY AFTER ALL OTHER SUPERBLOCK ELEMENTS HAVE BEEN FINALIZED
+static uint32_t superblock_crc_finalize(superblock_t *sb) {
+    sb->checksum = 0;
+    uint32_t c = crc32(sb, BS - 4);
+    sb->checksum = c;
+    return c;
+}
+
+// sb must point at the start of a full BS-sized block 0 buffer
+static uint64_t sb_itable_init_blocks(const superblock_t* sb) {
+    uint64_t v;
+    memcpy(&v,(const uint8_t*)sb+SB_ITABLE_INIT_OFF,sizeof(v));
+    return v;
+}
+static void sb_set_itable_init_blocks(superblock_t* sb, uint64_t v) {
+    memcpy((uint8_t*)sb+SB_ITABLE_INIT_OFF,&v,sizeof(v));
+}
+
+// WARNING: CALL THIS ONLY AFTER ALL OTHER INODE ELEMENTS HAVE BEEN FINALIZED
+static uint32_t inode_crc_finalize(inode_t* in) {
+    // low 4 bytes store crc32 of bytes [0..119]; high 4 bytes 0
+    in->inode_crc = 0;
+    uint32_t c = crc32(in, 120);
+    in->inode_crc = (uint64_t)c; // high 4 bytes remain 0
+    return c;
+}
+
+// Initializes inode table blocks [high-water mark..upto_blk] of a lazily
+// formatted image (empty inodes with valid CRCs) and advances the high-water mark.
+// Returns the number of blocks initialized.
+static uint64_t itable_lazy_init(superblock_t* sb, uint8_t* inode_table, uint64_t upto_blk) {
+    if(!(sb->flags & SB_FLAG_ITABLE_UNINIT) || upto_blk<sb_itable_init_blocks(sb)) return 0;
+    if(upto_blk>=sb->inode_table_blocks) upto_blk=sb->inode_table_blocks-1;
+    uint64_t inodes_per_block=BS/INODE_SIZE;
+    uint64_t first=sb_itable_init_blocks(sb);
+    for(uint64_t blk=first; blk<=upto_blk; blk++){
+        for(uint64_t slot=0; slot<inodes_per_block; slot++){
+            if(blk*inodes_per_block+slot>=sb->inode_count) break;
+            inode_t ino; memset(&ino,0,sizeof(ino));
+            inode_crc_finalize(&ino);
+            memcpy(inode_table+blk*BS+slot*INODE_SIZE,&ino,sizeof(ino));
+        }
+    }
+    sb_set_itable_init_blocks(sb,upto_blk+1);
+    if(upto_blk+1==sb->inode_table_blocks){
+        // table complete: back to a plain version 1 image
+        sb->flags &= ~SB_FLAG_ITABLE_UNINIT;
+        sb->version=SB_VERSION;
+        sb_set_itable_init_blocks(sb,0);
+    }
+    return upto_blk+1-first;
+}
+
+// one pending relocation: data block `src` moves to `dst` (absolute block numbers)
+typedef struct {
+    uint32_t src;
+    uint32_t dst;
+} move_t;
+
+typedef struct {
+    uint64_t files;       // allocated inodes that own at least one block
+    uint64_t blocks;      // data blocks referenced by those inodes
+    uint64_t extents;     // contiguous runs across all files
+    uint64_t fragmented;  // files made of more than one run
+    uint64_t high_block;  // highest data block in use, relative to data_region_start (+1)
+} frag_stats_t;
+
+static void frag_scan(const superblock_t* sb, const uint8_t* inode_bitmap,
+                      const uint8_t* inode_table, frag_stats_t* st) {
+    memset(st,0,sizeof(*st));
+    for(uint64_t i=0;i<sb->inode_count;i++){
+        if(((inode_bitmap[i>>3u]>>(i&7u))&1u)==0u) continue;
+        const inode_t* in=(const inode_t*)(inode_table+i*INODE_SIZE);
+        uint64_t runs=0; uint32_t prev=0;
+        for(int d=0;d<DIRECT_MAX;d++){
+            uint32_t b=in->direct[d];
+            if(b==0) continue;
+            if(runs==0 || b!=prev+1) runs++;
+            prev=b;
+            st->blocks++;
+            uint64_t rel=(uint64_t)b - sb->data_region_start + 1;
+            if(rel>st->high_block) st->high_block=rel;
+        }
+        if(runs==0) continue;
+        st->files++;
+        st->extents+=runs;
+        if(runs>1) st->fragmented++;
+    }
+}
+
+static void frag_print(const char* label, const frag_stats_t* st) {
+    printf("%s: %" PRIu64 " file(s), %" PRIu64 " block(s), %" PRIu64 " extent(s), "
+           "%" PRIu64 " fragmented file(s), data high-water mark %" PRIu64 "\n",
+           label, st->files, st->blocks, st->extents, st->fragmented, st->high_block);
+}
+
+// true when blocks [start, start+n) are a non-empty range inside the image, past the superblock
+static int range_ok(uint64_t start, uint64_t n, uint64_t total) {
+    return start>=1 && n>=1 && start<=total && n<=total-start;
+}
+
+// Writes the image to a temporary file next to `path`, fsyncs it and renames
+// it over `path`, so a failed write never truncates or half-overwrites an
+// existing image (in particular the input when compacting in place).
+// Relocated runs overlap blocks other files still use, so patching the
+// input block by block could not give the same guarantee.
+static int write_image_atomic(const char* path, const uint8_t* img, size_t n, mode_t mode) {
+    size_t len=strlen(path);
+    char* tmp=(char*)malloc(len+sizeof(".XXXXXX"));
+    if(!tmp){ fprintf(stderr,"OOM\n"); return -1; }
+    memcpy(tmp,path,len);
+    memcpy(tmp+len,".XXXXXX",sizeof(".XXXXXX"));
+    int fd=mkstemp(tmp);
+    if(fd<0){ fprintf(stderr,"Error: creating temporary file for '%s': %s\n", path, strerror(errno)); free(tmp); return -1; }
+    const char* step="fchmod";
+    int ok = fchmod(fd,mode)==0;
+    for(size_t off=0; ok && off<n; ){
+        ssize_t w=write(fd,img+off,n-off);
+        if(w<=0){ if(w==0) errno=EIO; step="write"; ok=0; break; }
+        off+=(size_t)w;
+    }
+    if(ok && fsync(fd)!=0){ step="fsync"; ok=0; }
+    if(close(fd)!=0 && ok){ step="close"; ok=0; }
+    if(ok && rename(tmp,path)!=0){ step="rename"; ok=0; }
+    if(!ok){
+        fprintf(stderr,"Error: %s '%s': %s\n", step, tmp, strerror(errno));
+        unlink(tmp);
+    }
+    free(tmp);
+    return ok?0:-1;
+}
+
+static double now_ms(void) {
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return (double)ts.tv_sec*1000.0 + (double)ts.tv_nsec/1e6;
+}
+
+int main(int argc, char** argv) {
+    crc32_init();
+
+    const char *in_path=NULL, *out_path=NULL;
+    int shrink=0;
+    for(int i=1;i<argc;i++){
+        if(strcmp(argv[i],"--input")==0 && i+1<argc){ in_path=argv[++i]; }
+        else if(strcmp(argv[i],"--output")==0 && i+1<argc){ out_path=argv[++i]; }
+        else if(strcmp(argv[i],"--shrink")==0){ shrink=1; }
+    }
+    if(!in_path || !out_path){
+        fprintf(stderr,"Usage: %s --input in.img --output out.img [--shrink]\n", argv[0]);
+        return 1;
+    }
+
+    FILE* fi = fopen(in_path,"rb");
+    if(!fi){ perror("fopen input"); return 1; }
+    fseek(fi,0,SEEK_END);
+    long fsz = ftell(fi);
+    fseek(fi,0,SEEK_SET);
+    if(fsz<(long)BS){ fclose(fi); fprintf(stderr,"Error: image too small\n"); return 1; }
+    size_t img_bytes = (size_t)fsz;
+    uint8_t* img = (uint8_t*)malloc(img_bytes);
+    if(!img){ fclose(fi); fprintf(stderr,"OOM\n"); return 1; }
+    if(fread(img,1,img_bytes,fi)!=img_bytes){ fclose(fi); free(img); fprintf(stderr,"read image failed\n"); return 1; }
+    fclose(fi);
+
+    superblock_t* sb = (superblock_t*)img;
+    uint64_t inodes_per_block=BS/INODE_SIZE;
+    if(sb->magic!=MAGIC || sb->block_size!=BS || sb->total_blocks>img_bytes/BS
+       || !range_ok(sb->inode_bitmap_start,sb->inode_bitmap_blocks,sb->total_blocks)
+       || !range_ok(sb->data_bitmap_start,sb->data_bitmap_blocks,sb->total_blocks)
+       || !range_ok(sb->inode_table_start,sb->inode_table_blocks,sb->total_blocks)
+       || !range_ok(sb->data_region_start,sb->data_region_blocks,sb->total_blocks)
+       || sb->inode_count>sb->inode_table_blocks*inodes_per_block || sb->inode_count>(uint64_t)BS*8u
+       || sb->data_region_blocks>(uint64_t)BS*8u){
+        fprintf(stderr,"Error: '%s' is not a valid MiniVSFS image\n", in_path);
+        free(img); return 1;
+    }
+    if(sb->version!=SB_VERSION && sb->version!=SB_VERSION_LAZY_ITABLE){
+        fprintf(stderr,"Error: unsupported MiniVSFS version %u\n", sb->version);
+        free(img); return 1;
+    }
+    if((sb->flags & SB_FLAG_ITABLE_UNINIT)
+       && (sb->version!=SB_VERSION_LAZY_ITABLE || sb_itable_init_blocks(sb)==0 || sb_itable_init_blocks(sb)>sb->inode_table_blocks)){
+        fprintf(stderr,"Error: '%s' has a corrupt inode table high-water mark\n", in_path);
+        free(img); return 1;
+    }
+    uint8_t* inode_bitmap = img + sb->inode_bitmap_start*BS;
+    uint8_t* data_bitmap  = img + sb->data_bitmap_start*BS;
+    uint8_t* inode_table  = img + sb->inode_table_start*BS;
+    uint8_t* data_region  = img + sb->data_region_start*BS;
+
+    double t0 = now_ms();
+
+    // direct[] of every allocated inode is about to be trusted, so refuse to
+    // touch an image whose inodes do not verify
+    for(uint64_t i=0;i<sb->inode_count;i++){
+        if(((inode_bitmap[i>>3u]>>(i&7u))&1u)==0u) continue;
+        const inode_t* in=(const inode_t*)(inode_table+i*INODE_SIZE);
+        if(in->inode_crc!=(uint64_t)crc32(in,120)){
+            fprintf(stderr,"Error: inode #%" PRIu64 " fails its CRC check, refusing to compact\n", i+1);
+            free(img); return 1;
+        }
+    }
+
+    frag_stats_t before;
+    frag_scan(sb,inode_bitmap,inode_table,&before);
+
+    // Plan: walk allocated inodes in index order and hand out destination
+    // blocks from the start of the data region, so each file ends up as one run.
+    move_t* moves = (move_t*)malloc((size_t)(before.blocks?before.blocks:1)*sizeof(move_t));
+    uint8_t* seen = (uint8_t*)calloc(1,(size_t)(sb->data_region_blocks/8+1));
+    if(!moves || !seen){ free(moves); free(seen); free(img); fprintf(stderr,"OOM\n"); return 1; }
+
+    uint64_t nmoves=0, relocated=0;
+    uint64_t cursor=sb->data_region_start;
+    for(uint64_t i=0;i<sb->inode_count;i++){
+        if(((inode_bitmap[i>>3u]>>(i&7u))&1u)==0u) continue;
+        inode_t* in=(inode_t*)(inode_table+i*INODE_SIZE);
+        int moved=0;
+        for(int d=0;d<DIRECT_MAX;d++){
+            uint32_t b=in->direct[d];
+            if(b==0) continue;
+            if(b<sb->data_region_start || b>=sb->data_region_start+sb->data_region_blocks){
+                fprintf(stderr,"Error: inode #%" PRIu64 " points outside the data region (block %u)\n", i+1, b);
+                free(moves); free(seen); free(img); return 1;
+            }
+            uint64_t rel=b-sb->data_region_start;
+            if((seen[rel>>3u]>>(rel&7u))&1u){
+                fprintf(stderr,"Error: block %u is shared by more than one file, refusing to compact\n", b);
+                free(moves); free(seen); free(img); return 1;
+            }
+            seen[rel>>3u] |= (uint8_t)(1u<<(rel&7u));
+            moves[nmoves].src=b;
+            moves[nmoves].dst=(uint32_t)cursor;
+            if(b!=cursor){ relocated++; moved=1; }
+            nmoves++;
+            in->direct[d]=(uint32_t)cursor++;
+        }
+        if(moved) inode_crc_finalize(in);
+    }
+    free(seen);
+    uint64_t used=cursor-sb->data_region_start;
+
+    // Destinations are always sequential, so every run of sequential sources
+    // becomes a single memcpy. A run either stays put (src==dst throughout) and
+    // is skipped, or moves as a whole. Moving runs are staged in a scratch
+    // buffer first so overlapping moves cannot clobber each other.
+    uint64_t batches=0;
+    if(relocated){
+        uint8_t* packed = (uint8_t*)malloc((size_t)relocated*BS);
+        if(!packed){ free(moves); free(img); fprintf(stderr,"OOM\n"); return 1; }
+        for(int pass=0;pass<2;pass++){
+            size_t off=0;
+            for(uint64_t i=0;i<nmoves;){
+                uint64_t run=1;
+                while(i+run<nmoves && moves[i+run].src==moves[i].src+run) run++;
+                if(moves[i].src!=moves[i].dst){
+                    if(pass==0){
+                        memcpy(packed+off,data_region+(moves[i].src-sb->data_region_start)*(size_t)BS,(size_t)run*BS);
+                        batches++;
+                    } else {
+                        memcpy(data_region+(moves[i].dst-sb->data_region_start)*(size_t)BS,packed+off,(size_t)run*BS);
+                    }
+                    off+=(size_t)run*BS;
+                }
+                i+=run;
+            }
+        }
+        free(packed);
+        // zero the blocks vacated past the packed region
+        if(before.high_block>used)
+            memset(data_region+used*BS,0,(size_t)(before.high_block-used)*BS);
+    }
+    free(moves);
+
+    int bitmap_changed=0;
+    for(uint64_t bi=0;bi<sb->data_region_blocks;bi++){
+        uint8_t want=(uint8_t)(bi<used);
+        if(((data_bitmap[bi>>3u]>>(bi&7u))&1u)!=want){
+            data_bitmap[bi>>3u] ^= (uint8_t)(1u<<(bi&7u));
+            bitmap_changed=1;
+        }
+    }
+
+    // finish any lazy inode table initialization while the image is being rewritten anyway
+    uint64_t itable_inited=itable_lazy_init(sb,inode_table,sb->inode_table_blocks-1);
+
+    uint64_t old_total=sb->total_blocks;
+    if(shrink){
+        // keep at least one data block so the region is never empty
+        uint64_t keep = used?used:1;
+        sb->data_region_blocks=keep;
+        sb->total_blocks=sb->data_region_start+keep;
+    }
+    int changed = relocated || bitmap_changed || itable_inited || sb->total_blocks!=old_total;
+    if(changed){
+        sb->mtime_epoch=(uint64_t)time(NULL);
+        superblock_crc_finalize(sb);
+    }
+
+    frag_stats_t after;
+    frag_scan(sb,inode_bitmap,inode_table,&after);
+    double t1 = now_ms();
+
+    struct stat in_st, out_st;
+    int in_place = stat(in_path,&in_st)==0 && stat(out_path,&out_st)==0
+                   && in_st.st_dev==out_st.st_dev && in_st.st_ino==out_st.st_ino;
+    if(!changed && in_place){
+        free(img);
+        frag_print("Before",&before);
+        printf("Image is already compact, nothing to do (%.3f ms)\n", t1-t0);
+        return 0;
+    }
+
+    uint64_t new_total=sb->total_blocks;
+    mode_t mode = stat(out_path,&out_st)==0 ? (out_st.st_mode & 07777) : 0644;
+    if(write_image_atomic(out_path,img,(size_t)new_total*BS,mode)!=0){ free(img); return 1; }
+    free(img);
+    double t2 = now_ms();
+
+    frag_print("Before",&before);
+    frag_print("After ",&after);
+    printf("Relocated %" PRIu64 " block(s) in %" PRIu64 " batched copy(ies)\n", relocated, batches);
+    if(itable_inited)
+        printf("Initialized %" PRIu64 " lazily formatted inode table block(s)\n", itable_inited);
+    if(shrink)
+        printf("Shrunk image from %" PRIu64 " to %" PRIu64 " blocks\n", old_total, new_total);
+    printf("Compaction took %.3f ms (%.3f ms including write). Output: %s\n", t1-t0, t2-t0, out_path);
+
+    return 0;
+}